@@ -0,0 +1,210 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pty.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// Keystroke to echo latency
+// runs proto sessions behind ptys, types digits into them at a fixed rate
+// and times how long each digit takes to come back out of the guest
+// the guest has to echo what it reads, through GETC/IN or by polling KBSR
+enum{
+    MAX_SESSIONS = 256,
+    TIMEOUT_NS = 1000000000, // a key not echoed within a second is counted as lost
+};
+
+struct session {
+    int fd;
+    pid_t pid;
+    char pending;       // the digit waiting to come back, 0 when none
+    uint64_t sent_at;
+    uint64_t next_send;
+    int sent;
+    int dead;           // proto exited or the pty broke, its keys are counted as lost
+};
+
+struct session sessions[MAX_SESSIONS];
+int keys = 1000;
+uint64_t* latencies;
+size_t latency_count;
+size_t lost;
+
+uint64_t now_ns(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+int compare_latencies(const void* a, const void* b){
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(double p){
+    if (!latency_count) return 0;
+    size_t i = (size_t)(p * (latency_count - 1) + 0.5);
+    return latencies[i] / 1000.0;
+}
+
+// Starting a session
+// proto runs on the pty's slave side, the session is ready once proto has taken the terminal out of canonical mode
+int start_session(struct session* s, char** command){
+    s->pid = forkpty(&s->fd, NULL, NULL, NULL);
+    if (s->pid < 0) return 0;
+    if (s->pid == 0) {
+        execvp(command[0], command);
+        _exit(127);
+    }
+    struct termios tio;
+    for (int tries = 0; tries < 5000; tries++) {
+        if (tcgetattr(s->fd, &tio) == 0 && !(tio.c_lflag & ICANON)) return 1;
+        usleep(1000);
+    }
+    return 0;
+}
+
+// Losing a session
+// the digit in flight and every one not yet typed are lost, and the session leaves the poll set
+void end_session(struct session* s){
+    lost += (s->pending != 0) + (keys - s->sent);
+    s->pending = 0;
+    s->sent = keys;
+    s->dead = 1;
+}
+
+// Reading a session's output
+// anything before the pending digit is guest output such as prompts
+void read_session(struct session* s, uint64_t now){
+    char buf[4096];
+    ssize_t n = read(s->fd, buf, sizeof(buf));
+    if (n <= 0) {
+        end_session(s);
+        return;
+    }
+    for (ssize_t i = 0; i < n; i++) {
+        if (s->pending && buf[i] == s->pending) {
+            latencies[latency_count++] = now - s->sent_at;
+            s->pending = 0;
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int session_count = 1;
+    int rate = 100;
+    int opt;
+    int bad = 0;
+    // the first word that isn't an option starts the command, its own options are left alone
+    while ((opt = getopt(argc, argv, "+s:n:r:")) != -1) {
+        switch (opt) {
+            case 's': session_count = atoi(optarg); break;
+            case 'n': keys = atoi(optarg); break;
+            case 'r': rate = atoi(optarg); break;
+            default: bad = 1; break;
+        }
+    }
+    if (bad || optind >= argc || session_count < 1 || session_count > MAX_SESSIONS || keys < 1 || rate < 1) {
+        printf("latency [-s sessions] [-n keys per session] [-r keys per second] command...\n");
+        exit(1);
+    }
+    char** command = argv + optind;
+    latencies = calloc((size_t)keys * session_count, sizeof(uint64_t));
+
+    for (int i = 0; i < session_count; i++) {
+        if (!start_session(&sessions[i], command)) {
+            printf("ERROR : session %d didn't start\n", i + 1);
+            exit(1);
+        }
+    }
+
+    // sessions are spread over the interval so they don't all type at once
+    uint64_t interval = 1000000000ull / rate;
+    uint64_t start = now_ns();
+    for (int i = 0; i < session_count; i++) {
+        sessions[i].next_send = start + interval * i / session_count;
+    }
+
+    int done = 0;
+    while (done < session_count) {
+        uint64_t now = now_ns();
+        uint64_t wake = now + interval;
+        done = 0;
+        for (int i = 0; i < session_count; i++) {
+            struct session* s = &sessions[i];
+            if (s->pending && now - s->sent_at > TIMEOUT_NS) {
+                s->pending = 0;
+                ++lost;
+            }
+            if (s->sent == keys && !s->pending) {
+                ++done;
+                continue;
+            }
+            if (!s->pending && s->sent < keys && now >= s->next_send) {
+                s->pending = '0' + s->sent % 10;
+                s->sent_at = now_ns();
+                s->next_send += interval;
+                ++s->sent;
+                if (write(s->fd, &s->pending, 1) != 1) {
+                    end_session(s);
+                    ++done;
+                    continue;
+                }
+            }
+            if (!s->pending && s->next_send < wake) {
+                wake = s->next_send;
+            }
+        }
+
+        struct pollfd fds[MAX_SESSIONS];
+        for (int i = 0; i < session_count; i++) {
+            // poll() skips a negative fd, so a dead session doesn't wake it again
+            fds[i] = (struct pollfd){ sessions[i].dead ? -1 : sessions[i].fd, POLLIN, 0 };
+        }
+        now = now_ns();
+        int timeout = wake > now ? (int)((wake - now) / 1000000) : 0;
+        if (poll(fds, session_count, timeout) > 0) {
+            now = now_ns();
+            for (int i = 0; i < session_count; i++) {
+                // output still buffered when proto exits is read first, the read then fails and ends the session
+                if (fds[i].revents & POLLIN) {
+                    read_session(&sessions[i], now);
+                } else if (fds[i].revents & (POLLHUP | POLLERR)) {
+                    end_session(&sessions[i]);
+                }
+            }
+        }
+    }
+
+    // proto restores the terminal and exits on SIGINT
+    struct rusage usage;
+    double cpu = 0;
+    for (int i = 0; i < session_count; i++) {
+        kill(sessions[i].pid, SIGINT);
+        int status;
+        if (wait4(sessions[i].pid, &status, 0, &usage) > 0) {
+            cpu += usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+        }
+        close(sessions[i].fd);
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    qsort(latencies, latency_count, sizeof(uint64_t), compare_latencies);
+    printf("sessions : %d\n", session_count);
+    printf("keys : %zu echoed, %zu lost\n", latency_count, lost);
+    printf("latency p50 : %.1f us\n", percentile(0.50));
+    printf("latency p99 : %.1f us\n", percentile(0.99));
+    printf("latency p999 : %.1f us\n", percentile(0.999));
+    printf("cpu per session : %.1f%% (%.3f ms per key)\n", cpu / session_count / seconds * 100,
+           latency_count ? cpu * 1000 / latency_count : 0.0);
+    return lost ? 1 : 0;
+}
@@ -0,0 +1,188 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// Batch scaling
+// runs a corpus of images with proto --stats at 1, 2, 4, ... workers in parallel
+// each worker runs its share of the corpus one image after another, every run is its own VM
+// one CSV row per worker count, so scaling curves can be plotted straight from the output
+enum{
+    MAX_WORKERS = 1024,
+};
+
+struct worker {
+    pid_t pid;
+    int stats;          // read end of the run's stderr, holding the --stats report
+    uint64_t started;
+    int runs;
+};
+
+struct worker workers[MAX_WORKERS];
+const char* proto_path = "build/proto";
+char** images;
+int image_count;
+int next_image;
+
+uint64_t* run_times;
+size_t run_count;
+uint64_t instructions;
+uint64_t rss_total;
+long rss_max;
+int failed_runs;
+int any_failed;
+
+uint64_t now_ns(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+int compare_times(const void* a, const void* b){
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(double p){
+    if (!run_count) return 0;
+    size_t i = (size_t)(p * (run_count - 1) + 0.5);
+    return run_times[i] / 1e6;
+}
+
+// Starting a run
+// the guest gets no input and its output is thrown away, only the --stats report on stderr is kept
+int start_run(struct worker* w){
+    int fds[2];
+    if (pipe(fds) < 0) return 0;
+    const char* image = images[next_image++ % image_count];
+    w->started = now_ns();
+    w->pid = fork();
+    if (w->pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
+    }
+    if (w->pid == 0) {
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[0]);
+        execl(proto_path, proto_path, "--stats", image, (char*)NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+    w->stats = fds[0];
+    return 1;
+}
+
+// Finishing a run
+// the report is a few lines, so it is still sitting in the pipe once the run has exited
+void finish_run(struct worker* w, int status, const struct rusage* usage){
+    run_times[run_count++] = now_ns() - w->started;
+    char report[4096];
+    ssize_t n = read(w->stats, report, sizeof(report) - 1);
+    close(w->stats);
+    report[n > 0 ? n : 0] = 0;
+
+    const char* line = strstr(report, "instructions : ");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || !line) {
+        ++failed_runs;
+    }
+    if (line) {
+        instructions += strtoull(line + 15, NULL, 10);
+    }
+    rss_total += usage->ru_maxrss;
+    if (usage->ru_maxrss > rss_max) {
+        rss_max = usage->ru_maxrss;
+    }
+    ++w->runs;
+}
+
+// Running one worker count
+// every worker keeps one VM going until it has done its runs
+void run_step(int worker_count, int runs_per_worker){
+    run_count = 0;
+    instructions = 0;
+    rss_total = 0;
+    rss_max = 0;
+    failed_runs = 0;
+    next_image = 0;
+
+    uint64_t start = now_ns();
+    int active = 0;
+    for (int i = 0; i < worker_count; i++) {
+        workers[i].runs = 0;
+        workers[i].pid = 0;
+        if (start_run(&workers[i])) {
+            ++active;
+        }
+    }
+    while (active) {
+        int status;
+        struct rusage usage;
+        pid_t pid = wait4(-1, &status, 0, &usage);
+        if (pid < 0) break;
+        for (int i = 0; i < worker_count; i++) {
+            struct worker* w = &workers[i];
+            if (w->pid != pid) continue;
+            finish_run(w, status, &usage);
+            w->pid = 0;
+            if (w->runs == runs_per_worker || !start_run(w)) {
+                --active;
+            }
+            break;
+        }
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    qsort(run_times, run_count, sizeof(uint64_t), compare_times);
+    printf("%d,%zu,%d,%llu,%.6f,%.2f,%llu,%ld,%.3f,%.3f,%.3f\n",
+           worker_count, run_count, failed_runs, (unsigned long long)instructions, seconds,
+           seconds > 0 ? instructions / seconds / 1e6 : 0.0,
+           (unsigned long long)(run_count ? rss_total / run_count : 0), rss_max,
+           percentile(0.50), percentile(0.99), percentile(0.999));
+    fflush(stdout);
+    if (failed_runs) {
+        any_failed = 1;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int max_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int runs_per_worker = 10;
+    int opt;
+    int bad = 0;
+    while ((opt = getopt(argc, argv, "j:n:p:")) != -1) {
+        switch (opt) {
+            case 'j': max_workers = atoi(optarg); break;
+            case 'n': runs_per_worker = atoi(optarg); break;
+            case 'p': proto_path = optarg; break;
+            default: bad = 1; break;
+        }
+    }
+    if (bad || optind >= argc || max_workers < 1 || max_workers > MAX_WORKERS || runs_per_worker < 1) {
+        printf("scaling [-j max workers] [-n runs per worker] [-p proto] image-file1 ...\n");
+        exit(1);
+    }
+    images = argv + optind;
+    image_count = argc - optind;
+    run_times = calloc((size_t)max_workers * runs_per_worker, sizeof(uint64_t));
+
+    printf("workers,runs,failed,instructions,seconds,mips,rss_kb,rss_max_kb,p50_ms,p99_ms,p999_ms\n");
+    int worker_count = 1;
+    for (;;) {
+        run_step(worker_count, runs_per_worker);
+        if (worker_count == max_workers) break;
+        worker_count = worker_count * 2 < max_workers ? worker_count * 2 : max_workers;
+    }
+    return any_failed;
+}
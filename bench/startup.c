@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+// Startup latency
+// times proto from exec to its first guest instruction and from exec to exit
+// the first is taken with a probe image loaded after the given images, which prints one character
+// as soon as it runs, so their load time counts. the probe takes the guest's place at x3000,
+// so exec to exit is taken from a separate run of the images on their own
+extern char** environ;
+
+// LEA R0, x3003 / PUTS / HALT / .STRINGZ "!"
+const uint8_t probe[] = { 0x30, 0x00, 0xE0, 0x02, 0xF0, 0x22, 0xF0, 0x25, 0x00, 0x21, 0x00, 0x00 };
+
+uint64_t* first_times;
+uint64_t* exit_times;
+int first_count;
+int exit_count;
+int failed_runs;
+
+uint64_t now_ns(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+int compare_times(const void* a, const void* b){
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(uint64_t* times, int count, double p){
+    if (!count) return 0;
+    size_t i = (size_t)(p * (count - 1) + 0.5);
+    return times[i] / 1000.0;
+}
+
+double mean(uint64_t* times, int count){
+    uint64_t total = 0;
+    for (int i = 0; i < count; i++) {
+        total += times[i];
+    }
+    return count ? total / 1000.0 / count : 0;
+}
+
+// One run
+// posix_spawn keeps the harness's own fork out of the measurement
+// a probe run records when the probe's character arrives, any other run when proto exits
+void run(char** command, int probe_run){
+    int fds[2];
+    if (pipe(fds) < 0) {
+        ++failed_runs;
+        return;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addclose(&actions, fds[0]);
+
+    pid_t pid;
+    uint64_t start = now_ns();
+    int spawned = posix_spawn(&pid, command[0], &actions, NULL, command, environ) == 0;
+    close(fds[1]);
+    posix_spawn_file_actions_destroy(&actions);
+
+    char c = 0;
+    uint64_t first = 0;
+    if (spawned && probe_run && read(fds[0], &c, 1) == 1) {
+        first = now_ns();
+    }
+    char rest[256];
+    while (read(fds[0], rest, sizeof(rest)) > 0) {
+    }
+    close(fds[0]);
+    int status = 1;
+    if (spawned) {
+        waitpid(pid, &status, 0);
+    }
+    uint64_t end = now_ns();
+
+    if ((probe_run && c != '!') || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        ++failed_runs;
+        return;
+    }
+    if (probe_run) {
+        first_times[first_count++] = first - start;
+    } else {
+        exit_times[exit_count++] = end - start;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    const char* proto_path = "build/proto";
+    int runs = 1000;
+    int opt;
+    int bad = 0;
+    while ((opt = getopt(argc, argv, "n:p:")) != -1) {
+        switch (opt) {
+            case 'n': runs = atoi(optarg); break;
+            case 'p': proto_path = optarg; break;
+            default: bad = 1; break;
+        }
+    }
+    if (bad || runs < 1) {
+        printf("startup [-n runs] [-p proto] [image-file1] ...\n");
+        exit(1);
+    }
+
+    char probe_path[] = "/tmp/proto-probe-XXXXXX";
+    int fd = mkstemp(probe_path);
+    if (fd < 0 || write(fd, probe, sizeof(probe)) != sizeof(probe)) {
+        printf("ERROR : failed to write the probe image\n");
+        exit(1);
+    }
+    close(fd);
+
+    // the probe run loads the images and then the probe, the exit run just the images
+    int image_count = argc - optind;
+    char* probe_command[image_count + 3];
+    char* exit_command[image_count + 3];
+    probe_command[0] = exit_command[0] = (char*)proto_path;
+    for (int i = 0; i < image_count; i++) {
+        probe_command[i + 1] = exit_command[i + 1] = argv[optind + i];
+    }
+    probe_command[image_count + 1] = probe_path;
+    probe_command[image_count + 2] = NULL;
+    // without images of its own the probe is the tiny guest
+    exit_command[image_count + 1] = image_count ? NULL : probe_path;
+    exit_command[image_count + 2] = NULL;
+
+    first_times = calloc(runs, sizeof(uint64_t));
+    exit_times = calloc(runs, sizeof(uint64_t));
+    for (int i = 0; i < runs; i++) {
+        run(probe_command, 1);
+        run(exit_command, 0);
+    }
+    unlink(probe_path);
+
+    qsort(first_times, first_count, sizeof(uint64_t), compare_times);
+    qsort(exit_times, exit_count, sizeof(uint64_t), compare_times);
+    printf("runs : %d (%d failed)\n", first_count + exit_count, failed_runs);
+    printf("first instruction mean : %.1f us\n", mean(first_times, first_count));
+    printf("first instruction p50 : %.1f us\n", percentile(first_times, first_count, 0.50));
+    printf("first instruction p99 : %.1f us\n", percentile(first_times, first_count, 0.99));
+    printf("exit mean : %.1f us\n", mean(exit_times, exit_count));
+    printf("exit p50 : %.1f us\n", percentile(exit_times, exit_count, 0.50));
+    printf("exit p99 : %.1f us\n", percentile(exit_times, exit_count, 0.99));
+    return failed_runs ? 1 : 0;
+}
@@ -1,14 +1,33 @@
+#define _GNU_SOURCE
 #include <stdint.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <dlfcn.h>
+#include <sched.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/termios.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <linux/futex.h>
+#include <linux/perf_event.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "proto_plugin.h"
 
 // Storage
 #define MAX_MEMORY (1<<16)
@@ -44,6 +63,10 @@ enum{
     FL_NEG = 1 << 2,    // Negative
 };
 
+// Value of the most recently executed calculation
+// R_COND is only derived from it when the flags are read
+uint16_t flag_value;
+
 // Instruction Set
 // Each instruction has an OPcode and parameters
 // There are 16 OPcodes
@@ -75,26 +98,239 @@ enum{
     TRAP_IN = 0x23,     // Prompt for input character
     TRAP_PUTSP = 0x24,  // Outputs a string
     TRAP_HALT = 0x25,   // Halts (stops) the program
+    TRAP_HOST = 0x26,   // Calls the host function numbered in R0
 }; 
 
 // Memory Mapped Registers
 // used to read and write to registers
 enum{
+    IO_PAGE = 0xFE00, // Start of the memory mapped registers
     MR_KBSR = 0xFE00, // KeyBoard Status Register
     MR_KBDR = 0xFE02, // KeyBoard Data Register
+    MR_CHSR = 0xFE10, // CHannel Status Register
+    MR_CHTX = 0xFE12, // CHannel Transmit data register
+    MR_CHRX = 0xFE14, // CHannel Receive data register
+    MR_DMASR = 0xFE20, // DMA Source address Register
+    MR_DMADR = 0xFE22, // DMA Destination address Register
+    MR_DMALR = 0xFE24, // DMA Length Register, in words
+    MR_DMACR = 0xFE26, // DMA Control Register
+    MR_ICLO = 0xFE30, // Instruction Count, Low word
+    MR_ICHI = 0xFE32, // Instruction Count, High word
+    MR_CYLO = 0xFE34, // CYcle count, Low word
+    MR_CYHI = 0xFE36, // CYcle count, High word
+    MR_NSLO = 0xFE38, // host NanoSeconds, Low word
+    MR_NSHI = 0xFE3A, // host NanoSeconds, High word
+};
+
+// Channel status bits
+// in MR_CHSR
+enum{
+    CH_RX_READY = 1 << 15,  // a word can be received without blocking
+    CH_TX_READY = 1 << 14,  // a word can be sent without blocking
+    CH_RX_CLOSED = 1 << 13, // the sending stage has stopped and every word is received
+};
+
+// DMA control bits
+// in MR_DMACR
+enum{
+    DMA_START = 1 << 15, // written by the guest to start a copy
+    DMA_DONE = 1 << 14,  // set once the copy has finished
+};
+
+// Plugins
+// shared objects loaded with --plugin, see proto_plugin.h
+enum{
+    MAX_PLUGINS = 16,
+    MAX_DEVICES = 32,
+};
+proto_host_fn host_functions[PROTO_HOST_FUNCTIONS];
+struct proto_device devices[MAX_DEVICES];
+int device_count;
+int device_ticks; // devices with a tick callback
+// device answering for each plugin register, indexed from PROTO_DEVICE_FIRST
+struct proto_device* device_map[MAX_MEMORY - PROTO_DEVICE_FIRST];
+
+// Memory policy flags for get_mempolicy
+// from linux/mempolicy.h, used to find the node backing guest memory
+enum{
+    MPOL_F_NODE = 1 << 0,
+    MPOL_F_ADDR = 1 << 1,
+};
+
+// Flight recorder
+// the last TRACE_SIZE instructions executed, each as pc << 16 | instruction
+// written out with the registers and memory to a postmortem file when the guest dies
+enum{
+    TRACE_SIZE = 256,
+    MAX_SYMBOLS = 1024,
+};
+uint32_t trace[TRACE_SIZE];
+char postmortem_path[256];
+volatile sig_atomic_t postmortem_written;
+unsigned int watchdog_seconds;
+
+// Postmortem reasons
+enum{
+    PM_ILLEGAL_OPCODE = 1, // detail is the instruction
+    PM_WATCHDOG,           // detail is the watchdog in seconds
+    PM_REQUEST,            // SIGUSR2, the guest keeps running
+    PM_SIGNAL,             // proto itself crashed, detail is the signal
+    PM_PRIVILEGE,          // RTI outside supervisor mode, detail is the instruction
+    PM_HOST_FUNCTION,      // detail is the missing host function number
+};
+
+// Run statistics
+// counted in the main loop and printed with --stats
+uint64_t instr_count;
+uint64_t cycle_count;
+struct timespec run_start;
+
+// Cost model
+// virtual cycles per opcode, one to execute plus one for every data memory access
+const uint8_t op_cycles[16] = {
+    1, 1, 2, 2,  // BR, ADD, LD, ST
+    1, 1, 2, 2,  // JSR, AND, LDR, STR
+    1, 1, 3, 3,  // RTI, NOT, LDI, STI
+    1, 1, 1, 2,  // JMP, RES, LEA, TRAP
 };
 
+// Host hardware counters
+// opened around the run loop with --hwcounters
+enum{
+    HW_CYCLES = 0,
+    HW_INSTRUCTIONS,
+    HW_BRANCH_MISSES,
+    HW_L1I_MISSES,
+    HW_L1D_MISSES,
+    HW_DTLB_MISSES,
+    HW_COUNT
+};
+const char* hw_names[HW_COUNT] = {
+    "cycles", "instructions", "branch misses", "L1i misses", "L1d misses", "dTLB misses",
+};
+int hw_fds[HW_COUNT] = { -1, -1, -1, -1, -1, -1 };
+
+// Opcode profile
+// bigram and trigram counts of instruction shapes, collected with --profile
+// a shape is the opcode plus its mode bit for ADD, AND (immediate) and JSR (offset)
+enum{
+    SHAPE_COUNT = 32,
+    PROFILE_TOP = 10,
+};
+const char* shape_names[SHAPE_COUNT] = {
+    "BR", NULL, "ADD", "ADDi", "LD", NULL, "ST", NULL,
+    "JSRR", "JSR", "AND", "ANDi", "LDR", NULL, "STR", NULL,
+    "RTI", NULL, "NOT", NULL, "LDI", NULL, "STI", NULL,
+    "JMP", NULL, "RES", NULL, "LEA", NULL, "TRAP", NULL,
+};
+uint64_t bigrams[SHAPE_COUNT][SHAPE_COUNT];
+uint64_t trigrams[SHAPE_COUNT][SHAPE_COUNT][SHAPE_COUNT];
+uint64_t profile_instrs;
+int shape_history[2] = { -1, -1 };
+
+// Script
+// drives the guest from a file with --script instead of the terminal
+// "send text" queues keys, "expect text" runs the guest until text shows up in its output
+enum{
+    KEY_QUEUE_SIZE = 4096,
+    EXPECT_WINDOW = 4096,
+    EXPECT_TEXT = 256,
+    EXPECT_LIMIT = 100000000, // instructions an expect may wait for
+};
+FILE* script_file;
+int script_line;
+int script_failed;
+int expecting;
+char expect_text[EXPECT_TEXT];
+size_t expect_len;
+uint64_t expect_deadline;
+char key_queue[KEY_QUEUE_SIZE];
+size_t key_head, key_tail;
+char out_window[EXPECT_WINDOW];
+size_t window_len;
+
+// Pipeline
+// with --pipe each stage runs in its own process on its own core
+// a stage's output feeds the next stage's keyboard through a ring in shared memory
+enum{
+    MAX_STAGES = 16,
+    RING_SIZE = 1 << 16,
+    RING_SPINS = 1000, // polls before sleeping on the futex
+};
+struct ring {
+    _Atomic uint32_t head;          // advanced by the reading stage
+    _Atomic uint32_t head_waiting;
+    _Atomic uint32_t reader_closed; // the reading stage has stopped
+    char pad1[52];
+    _Atomic uint32_t tail;          // advanced by the writing stage
+    _Atomic uint32_t tail_waiting;
+    _Atomic uint32_t closed;        // the writing stage has stopped
+    char pad2[52];
+    char data[RING_SIZE];
+};
+struct ring* in_ring;
+struct ring* out_ring;
+
+// Channels
+// a second ring per link that carries 16-bit words between the guests through MR_CHTX and MR_CHRX
+struct ring* in_chan;
+struct ring* out_chan;
+struct ring* pipeline_rings; // every link's keyboard ring, then every link's channel
+int stage;
+int stage_count = 1;
+pid_t stage_pids[MAX_STAGES];
+
+// Hibernation
+// with --hibernate a guest left waiting for a key that many seconds is written to a compact snapshot
+// (registers, run length coded memory and device state), its memory is handed back to the host and the next key thaws it
+// the snapshot lives in a memfd, or in a file under --hibernate-dir
+enum{
+    POLL_LOOP = 16, // instructions between polls from one place that still count as spinning on KBSR
+};
+int hibernate_seconds;
+const char* hibernate_dir;
+char snapshot_path[256];
+time_t idle_since;  // the last key, or output or device activity seen by a polling guest
+int guest_busy;     // output or device writes since the last keyboard poll
+uint16_t poll_pc;   // where the last keyboard poll came from
+uint64_t poll_count; // and at which instruction
+uint64_t hibernations;
+long snapshot_bytes; // size of the last snapshot
+
+// Set to 0 to stop the main loop
+volatile sig_atomic_t running;
+
+// Stop reasons
+// why the guest stopped, also proto's exit status
+// a fault only stops the guest it happened in, pipeline stages around it carry on
+enum{
+    STOP_HALT = 0,
+    STOP_ILLEGAL_OPCODE = 2,
+    STOP_PRIVILEGE = 3,     // RTI, proto guests always run in user mode
+    STOP_WATCHDOG = 4,
+    STOP_HOST_FUNCTION = 5, // TRAP x26 with nothing registered under R0
+};
+const char* stop_names[] = {
+    "halted", NULL, "illegal instruction", "RTI in user mode", "watchdog expired", "no such host function",
+};
+volatile sig_atomic_t stop_reason;
+
 struct termios original_tio;
+int input_buffering_disabled;
 
 void disable_input_buffering(){
-    tcgetattr(STDIN_FILENO, &original_tio);
+    // not a terminal, there is nothing to change or restore
+    if (tcgetattr(STDIN_FILENO, &original_tio) < 0) return;
     struct termios new_tio = original_tio;
     new_tio.c_lflag &= ~ICANON & ~ECHO;
     tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+    input_buffering_disabled = 1;
 }
 
 void restore_input_buffering(){
-    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+    if (input_buffering_disabled) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+    }
 }
 
 uint16_t check_key(){
@@ -108,12 +344,6 @@ uint16_t check_key(){
     return select(1, &readfds, NULL, NULL, &timeout) != 0;
 }
 
-void handle_interrupt(int signal){
-    restore_input_buffering();
-    printf("\n");
-    exit(-2);
-}
-
 // Sign Extension
 // fills zeroes for positive numbers, ones for negative numbers
 uint16_t sign_extend(uint16_t x, int bit_count){
@@ -124,15 +354,23 @@ uint16_t sign_extend(uint16_t x, int bit_count){
 }
 
 // Update Flags
-// checks if a number is positive, negative or zero and updates the condition flag accordingly
+// remembers the result so back to back calculations only cost a store
+// the condition flag is worked out by cond_flags() when something reads it
 void update_flags(uint16_t r){
-    if (registers[r] == 0) {
+    flag_value = registers[r];
+}
+
+// Condition Flags
+// checks if the last result is positive, negative or zero and updates the condition flag accordingly
+uint16_t cond_flags(){
+    if (flag_value == 0) {
         registers[R_COND] = FL_ZRO;
-    } else if (registers[r] >> 15) { // 1 in the left most bit indicates a negative number
+    } else if (flag_value >> 15) { // 1 in the left most bit indicates a negative number
         registers[R_COND] = FL_NEG;
     } else {
         registers[R_COND] = FL_POS;
     }
+    return registers[R_COND];
 }
 
 // Swap each uint16 that is loaded
@@ -142,83 +380,1593 @@ uint16_t swap16(uint16_t x){
 }
 
 // Reading image files
-// a function to read image files
-void read_image_file(FILE* file){
+// a function to read an image already in memory, 0 if it is too short to hold its origin
+int read_image_file(const uint8_t* data, size_t size){
     uint16_t origin;
-    fread(&origin, sizeof(origin), 1, file);
+    if (size < sizeof(origin)) return 0;
+    memcpy(&origin, data, sizeof(origin));
     origin = swap16(origin);
-    uint16_t max_read = MAX_MEMORY - origin;
+    size_t max_read = MAX_MEMORY - origin;
+    size_t read = (size - sizeof(origin)) / sizeof(uint16_t);
+    if (read > max_read) {
+        read = max_read;
+    }
     uint16_t* p = memory + origin;
-    size_t read = fread(p, sizeof(uint16_t), max_read, file);
+    memcpy(p, data + sizeof(origin), read * sizeof(uint16_t));
     while (read --> 0) {
         *p = swap16(*p);
         ++p;
     }
+    return 1;
 }
 
 // Reading images
+// a regular file is mapped rather than read through stdio, saving a buffer and a copy on short runs
+// pipes, FIFOs and /dev/stdin have no size to map, so they are read up to the largest image instead
 int read_image(const char* image_path){
-    FILE* file = fopen(image_path, "rb");
-    if (!file) { return 0;};
-    read_image_file(file);
+    static uint8_t buffer[sizeof(uint16_t) + 2 * MAX_MEMORY];
+    int fd = open(image_path, O_RDONLY);
+    if (fd < 0) { return 0;};
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return 0;
+    }
+    void* data = MAP_FAILED;
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    int ok;
+    if (data != MAP_FAILED) {
+        ok = read_image_file(data, st.st_size);
+        munmap(data, st.st_size);
+    } else {
+        size_t size = 0;
+        ssize_t n = 1;
+        while (size < sizeof(buffer) && n > 0) {
+            n = read(fd, buffer + size, sizeof(buffer) - size);
+            if (n < 0 && errno == EINTR) {
+                n = 1;
+            } else if (n > 0) {
+                size += n;
+            }
+        }
+        ok = n >= 0 && read_image_file(buffer, size);
+    }
+    close(fd);
+    return ok;
+}
+
+// Writing everything
+// carries on after partial writes, 0 if the file can't take it all
+// only uses write() so it is safe from signal handlers
+int write_all(int fd, const void* buf, size_t len){
+    const char* p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+// Writing memory compactly
+// the non-zero parts of memory as start, length and words, ended by a zero length run
+// a run ends after 8 zero words in a row, only uses write() so it is safe from signal handlers
+// returns 0 if the runs couldn't all be written
+int write_memory_runs(int fd){
+    uint32_t address = 0;
+    while (address < MAX_MEMORY) {
+        while (address < MAX_MEMORY && !memory[address]) {
+            ++address;
+        }
+        if (address == MAX_MEMORY) break;
+        uint32_t end = address;
+        for (uint32_t a = address; a < MAX_MEMORY && a < end + 8; a++) {
+            if (memory[a]) end = a + 1;
+        }
+        uint32_t run[2] = { address, end - address };
+        if (!write_all(fd, run, sizeof(run)) || !write_all(fd, memory + address, run[1] * sizeof(uint16_t))) {
+            return 0;
+        }
+        address = end;
+    }
+    uint32_t last[2] = { 0, 0 };
+    return write_all(fd, last, sizeof(last));
+}
+
+// Reading memory back
+// fills memory from the runs, the rest is left as it is, 0 if they are cut short
+int read_memory_runs(FILE* file, uint32_t* runs, uint32_t* words){
+    uint32_t run[2];
+    while (fread(run, sizeof(run), 1, file) == 1) {
+        if (run[1] == 0) return 1;
+        if (run[0] + run[1] > MAX_MEMORY || fread(memory + run[0], sizeof(uint16_t), run[1], file) != run[1]) break;
+        ++*runs;
+        *words += run[1];
+    }
+    return 0;
+}
+
+// Writing a postmortem
+// only uses write() so it is safe from signal handlers
+// layout : "PROTOPM1", reason, detail, instruction count, registers, trace length, the trace oldest first,
+// then memory as written by write_memory_runs()
+void write_postmortem(uint32_t reason, uint32_t detail){
+    int fd = open(postmortem_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return;
+    cond_flags();
+    uint32_t header[2] = { reason, detail };
+    uint64_t count = instr_count < TRACE_SIZE ? instr_count : TRACE_SIZE;
+    uint32_t trace_count = count;
+    // instruction n is in trace[n % TRACE_SIZE], so the oldest may be in the middle
+    uint32_t oldest = (instr_count - count + 1) % TRACE_SIZE;
+    uint32_t first_part = TRACE_SIZE - oldest < count ? TRACE_SIZE - oldest : count;
+    int ok = write_all(fd, "PROTOPM1", 8)
+             && write_all(fd, header, sizeof(header))
+             && write_all(fd, &instr_count, sizeof(instr_count))
+             && write_all(fd, registers, sizeof(registers))
+             && write_all(fd, &trace_count, sizeof(trace_count))
+             && write_all(fd, trace + oldest, first_part * sizeof(uint32_t))
+             && write_all(fd, trace, (count - first_part) * sizeof(uint32_t))
+             && write_memory_runs(fd);
+    close(fd);
+    // a cut short postmortem doesn't count, a crash after it still gets to write one
+    if (ok) {
+        postmortem_written = 1;
+    }
+}
+
+// SIGUSR2 writes a postmortem of the running guest
+void handle_dump_request(int signal){
+    write_postmortem(PM_REQUEST, signal);
+    postmortem_written = 0;
+}
+
+// Faulting
+// stops the guest with a postmortem, the rest of proto shuts down as it would after HALT
+void fault(int reason, uint32_t pm_reason, uint32_t detail){
+    write_postmortem(pm_reason, detail);
+    stop_reason = reason;
+    running = 0;
+}
+
+void handle_watchdog(int signal){
+    fault(STOP_WATCHDOG, PM_WATCHDOG, watchdog_seconds);
+}
+
+// Disassembling
+// the assembly for the instruction at pc, as the postmortem viewer shows it
+void disassemble(uint16_t pc, uint16_t instr, char* out, size_t size){
+    const char* names[16] = {
+        "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+        "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP",
+    };
+    uint16_t op = instr >> 12;
+    int r0 = (instr >> 9) & 0x7;
+    int r1 = (instr >> 6) & 0x7;
+    uint16_t target = pc + 1 + sign_extend(instr & 0x1FF, 9);
+    switch (op) {
+        case OP_BR:
+            snprintf(out, size, "BR%s%s%s x%04X", (instr >> 11) & 1 ? "n" : "", (instr >> 10) & 1 ? "z" : "",
+                     (instr >> 9) & 1 ? "p" : "", target);
+            break;
+        case OP_ADD:
+        case OP_AND:
+            if ((instr >> 5) & 0x1) {
+                snprintf(out, size, "%s R%d, R%d, #%d", names[op], r0, r1, (int16_t)sign_extend(instr & 0x1F, 5));
+            } else {
+                snprintf(out, size, "%s R%d, R%d, R%d", names[op], r0, r1, instr & 0x7);
+            }
+            break;
+        case OP_NOT:
+            snprintf(out, size, "NOT R%d, R%d", r0, r1);
+            break;
+        case OP_LD:
+        case OP_ST:
+        case OP_LDI:
+        case OP_STI:
+        case OP_LEA:
+            snprintf(out, size, "%s R%d, x%04X", names[op], r0, target);
+            break;
+        case OP_LDR:
+        case OP_STR:
+            snprintf(out, size, "%s R%d, R%d, #%d", names[op], r0, r1, (int16_t)sign_extend(instr & 0x3F, 6));
+            break;
+        case OP_JMP:
+            if (r1 == R_R7) {
+                snprintf(out, size, "RET");
+            } else {
+                snprintf(out, size, "JMP R%d", r1);
+            }
+            break;
+        case OP_JSR:
+            if ((instr >> 11) & 1) {
+                snprintf(out, size, "JSR x%04X", (uint16_t)(pc + 1 + sign_extend(instr & 0x7FF, 11)));
+            } else {
+                snprintf(out, size, "JSRR R%d", r1);
+            }
+            break;
+        case OP_TRAP:
+            snprintf(out, size, "TRAP x%02X", instr & 0xFF);
+            break;
+        default:
+            snprintf(out, size, "%s", names[op]);
+            break;
+    }
+}
+
+// Symbols
+// read from an lc3as .sym file, lines like "//	LOOP   3004"
+char symbol_names[MAX_SYMBOLS][32];
+uint16_t symbol_addresses[MAX_SYMBOLS];
+int symbol_count;
+
+void load_symbols(const char* path){
+    FILE* file = fopen(path, "r");
+    if (!file) return;
+    char line[128];
+    char name[32];
+    unsigned int address;
+    while (symbol_count < MAX_SYMBOLS && fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "// %31s %x", name, &address) == 2) {
+            strcpy(symbol_names[symbol_count], name);
+            symbol_addresses[symbol_count++] = address;
+        }
+    }
+    fclose(file);
+}
+
+// Symbolizing an address
+// the closest symbol at or below it, as NAME or NAME+offset
+void symbolize(uint16_t address, char* out, size_t size){
+    int best = -1;
+    for (int i = 0; i < symbol_count; i++) {
+        if (symbol_addresses[i] <= address && (best < 0 || symbol_addresses[i] > symbol_addresses[best])) {
+            best = i;
+        }
+    }
+    if (best < 0) {
+        out[0] = 0;
+    } else if (symbol_addresses[best] == address) {
+        snprintf(out, size, "%s", symbol_names[best]);
+    } else {
+        snprintf(out, size, "%s+%u", symbol_names[best], address - symbol_addresses[best]);
+    }
+}
+
+// Showing a postmortem
+// prints the reason, the registers and the trace, symbolized when a .sym file is given
+int show_postmortem(const char* path, const char* symbols_path){
+    FILE* file = fopen(path, "rb");
+    if (!file) return 0;
+    char magic[8];
+    uint32_t header[2];
+    uint64_t count;
+    uint16_t regs[R_COUNT];
+    uint32_t trace_count;
+    if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, "PROTOPM1", 8) != 0
+        || fread(header, sizeof(header), 1, file) != 1 || fread(&count, sizeof(count), 1, file) != 1
+        || fread(regs, sizeof(regs), 1, file) != 1 || fread(&trace_count, sizeof(trace_count), 1, file) != 1
+        || trace_count > TRACE_SIZE || fread(trace, sizeof(uint32_t), trace_count, file) != trace_count) {
+        fclose(file);
+        return 0;
+    }
+    uint32_t runs = 0, words = 0;
+    read_memory_runs(file, &runs, &words);
+    fclose(file);
+    if (symbols_path) {
+        load_symbols(symbols_path);
+    }
+
+    switch (header[0]) {
+        case PM_ILLEGAL_OPCODE: printf("reason : illegal instruction x%04X\n", header[1]); break;
+        case PM_WATCHDOG: printf("reason : watchdog expired after %u seconds\n", header[1]); break;
+        case PM_REQUEST: printf("reason : requested with SIGUSR2\n"); break;
+        case PM_SIGNAL: printf("reason : %s\n", strsignal(header[1])); break;
+        case PM_PRIVILEGE: printf("reason : RTI in user mode\n"); break;
+        case PM_HOST_FUNCTION: printf("reason : no host function %u\n", header[1]); break;
+        default: printf("reason : unknown (%u)\n", header[0]); break;
+    }
+    printf("instructions : %llu\n", (unsigned long long)count);
+    for (int r = R_R0; r <= R_R7; r++) {
+        printf("R%d x%04X%s", r, regs[r], r == R_R3 || r == R_R7 ? "\n" : "  ");
+    }
+    printf("PC x%04X  COND %s\n", regs[R_PC],
+           regs[R_COND] == FL_NEG ? "n" : regs[R_COND] == FL_ZRO ? "z" : "p");
+    printf("memory : %u words in %u runs\n", words, runs);
+    printf("last %u instructions :\n", trace_count);
+    char symbol[48], text[48];
+    for (uint32_t i = 0; i < trace_count; i++) {
+        uint16_t pc = trace[i] >> 16;
+        symbolize(pc, symbol, sizeof(symbol));
+        disassemble(pc, trace[i] & 0xFFFF, text, sizeof(text));
+        printf("  x%04X %-16s %s\n", pc, symbol, text);
+    }
+    return 1;
+}
+
+// Registering a host function
+// handed to plugins through struct proto_host
+int register_function(uint16_t number, proto_host_fn fn){
+    if (number >= PROTO_HOST_FUNCTIONS || host_functions[number] || !fn) return 0;
+    host_functions[number] = fn;
+    return 1;
+}
+
+// Registering a device
+// handed to plugins through struct proto_host
+int register_device(const struct proto_device* device){
+    if (device_count == MAX_DEVICES || device->first < PROTO_DEVICE_FIRST || device->last < device->first) return 0;
+    for (uint32_t address = device->first; address <= device->last; address++) {
+        if (device_map[address - PROTO_DEVICE_FIRST]) return 0;
+    }
+    struct proto_device* copy = &devices[device_count++];
+    *copy = *device;
+    for (uint32_t address = device->first; address <= device->last; address++) {
+        device_map[address - PROTO_DEVICE_FIRST] = copy;
+    }
+    if (copy->tick) {
+        ++device_ticks;
+    }
+    return 1;
+}
+
+// Ticking the devices
+void tick_devices(){
+    for (int i = 0; i < device_count; i++) {
+        if (devices[i].tick) {
+            devices[i].tick(devices[i].context, instr_count);
+        }
+    }
+}
+
+// Loading a plugin
+// opens the shared object and lets it register what it provides
+int load_plugin(const char* path){
+    static struct proto_host host = {
+        .register_function = register_function,
+        .register_device = register_device,
+    };
+    void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        fprintf(stderr, "%s\n", dlerror());
+        return 0;
+    }
+    int (*init)(struct proto_host*) = (int (*)(struct proto_host*))dlsym(handle, "proto_plugin_init");
+    return init && init(&host);
+}
+
+// Calling a host function
+// stops the guest if nothing is registered under the number in R0
+void call_host_function(){
+    uint16_t number = registers[R_R0];
+    if (number >= PROTO_HOST_FUNCTIONS || !host_functions[number]) {
+        fault(STOP_HOST_FUNCTION, PM_HOST_FUNCTION, number);
+        return;
+    }
+    host_functions[number](memory, registers);
+    update_flags(R_R0);
+}
+
+// Pinning to cores
+// parses a core list like "0-3,8" and restricts the process to it
+// done before the images are loaded so guest memory is first touched on the local node
+int pin_cpus(const char* list){
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    const char* p = list;
+    while (*p) {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= CPU_SETSIZE) return 0;
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first || last >= CPU_SETSIZE) return 0;
+            p = end;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, &set);
+        }
+        if (*p == ',') {
+            ++p;
+        } else if (*p) {
+            return 0;
+        }
+    }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+// Printing run statistics
+// throughput plus where the run and its memory ended up, to spot cross-node runs
+void print_stats(){
+    struct timespec run_end;
+    clock_gettime(CLOCK_MONOTONIC, &run_end);
+    double seconds = (run_end.tv_sec - run_start.tv_sec) + (run_end.tv_nsec - run_start.tv_nsec) / 1e9;
+    unsigned int cpu = 0, node = 0;
+    getcpu(&cpu, &node);
+    int mem_node = -1;
+    syscall(SYS_get_mempolicy, &mem_node, NULL, 0, memory, MPOL_F_NODE | MPOL_F_ADDR);
+
+    if (stage_count > 1) {
+        fprintf(stderr, "stage : %d\n", stage + 1);
+    }
+    fprintf(stderr, "instructions : %llu\n", (unsigned long long)instr_count);
+    fprintf(stderr, "seconds : %.6f\n", seconds);
+    fprintf(stderr, "MIPS : %.2f\n", seconds > 0 ? instr_count / seconds / 1e6 : 0.0);
+    fprintf(stderr, "cpu : %u (node %u)\n", cpu, node);
+    fprintf(stderr, "memory node : %d\n", mem_node);
+    if (hibernations) {
+        fprintf(stderr, "hibernations : %llu (last snapshot %ld bytes)\n", (unsigned long long)hibernations, snapshot_bytes);
+    }
+}
+
+// Script escapes
+// \n, \r, \t and \\ in send and expect text
+size_t unescape(const char* src, char* dst, size_t max){
+    size_t n = 0;
+    while (*src && n < max) {
+        char c = *src++;
+        if (c == '\\' && *src) {
+            c = *src++;
+            if (c == 'n') c = '\n';
+            else if (c == 'r') c = '\r';
+            else if (c == 't') c = '\t';
+        }
+        dst[n++] = c;
+    }
+    return n;
+}
+
+// Failing the script
+// stops the guest and reports the line that could not be satisfied
+void script_fail(const char* reason){
+    fprintf(stderr, "script : line %d : %s\n", script_line, reason);
+    script_failed = 1;
+    running = 0;
+}
+
+// Advancing the script
+// queues send lines until the next expect or the end of the file
+void script_advance(){
+    char line[EXPECT_TEXT + 16];
+    char text[EXPECT_TEXT];
+    while (!expecting && !script_failed && fgets(line, sizeof(line), script_file)) {
+        ++script_line;
+        line[strcspn(line, "\n")] = 0;
+        if (strncmp(line, "send ", 5) == 0) {
+            size_t len = unescape(line + 5, text, sizeof(text));
+            for (size_t i = 0; i < len; i++) {
+                if (key_tail - key_head == KEY_QUEUE_SIZE) {
+                    script_fail("key queue full");
+                    break;
+                }
+                key_queue[key_tail++ % KEY_QUEUE_SIZE] = text[i];
+            }
+        } else if (strncmp(line, "expect ", 7) == 0) {
+            expect_len = unescape(line + 7, expect_text, sizeof(expect_text));
+            expect_deadline = instr_count + EXPECT_LIMIT;
+            expecting = expect_len > 0;
+        } else if (line[0] && line[0] != '#') {
+            script_fail("unknown command");
+        }
+    }
+}
+
+// Checking script output
+// collects guest output and moves on once the expected text appears
+// output longer than the window goes through it a window at a time, so no part of it goes unsearched
+void script_output(const char* buf, size_t len){
+    while (expecting) {
+        if (window_len + len > EXPECT_WINDOW) {
+            // keep just enough of the old output for a match that straddles the new one
+            size_t keep = expect_len - 1;
+            if (keep > window_len) keep = window_len;
+            memmove(out_window, out_window + window_len - keep, keep);
+            window_len = keep;
+        }
+        size_t n = len < EXPECT_WINDOW - window_len ? len : EXPECT_WINDOW - window_len;
+        memcpy(out_window + window_len, buf, n);
+        window_len += n;
+        buf += n;
+        len -= n;
+
+        char* match = memmem(out_window, window_len, expect_text, expect_len);
+        if (match) {
+            size_t rest = out_window + window_len - (match + expect_len);
+            memmove(out_window, match + expect_len, rest);
+            window_len = rest;
+            expecting = 0;
+            script_advance();
+        } else if (len == 0) {
+            return;
+        }
+    }
+}
+
+// Waiting on a ring index
+// spins briefly, then sleeps until the other stage moves the index on
+void ring_wait(_Atomic uint32_t* index, _Atomic uint32_t* waiting, uint32_t seen){
+    for (int i = 0; i < RING_SPINS; i++) {
+        if (atomic_load(index) != seen) return;
+    }
+    atomic_store(waiting, 1);
+    if (atomic_load(index) == seen) {
+        struct timespec timeout = { 0, 10000000 };
+        syscall(SYS_futex, index, FUTEX_WAIT, seen, &timeout, NULL, 0);
+    }
+    atomic_store(waiting, 0);
+}
+
+void ring_wake(_Atomic uint32_t* index, _Atomic uint32_t* waiting){
+    if (atomic_load(waiting)) {
+        syscall(SYS_futex, index, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+// Writing to the next stage
+// blocks while the ring is full, output is dropped once the next stage or this guest has stopped
+void ring_write(struct ring* ring, const char* buf, size_t len){
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while (len > 0 && running && !atomic_load(&ring->reader_closed)) {
+        uint32_t head = atomic_load(&ring->head);
+        uint32_t space = RING_SIZE - (tail - head);
+        if (space == 0) {
+            ring_wait(&ring->head, &ring->head_waiting, head);
+            continue;
+        }
+        size_t n = len < space ? len : space;
+        for (size_t i = 0; i < n; i++) {
+            ring->data[(tail + i) % RING_SIZE] = buf[i];
+        }
+        tail += n;
+        buf += n;
+        len -= n;
+        atomic_store(&ring->tail, tail);
+        ring_wake(&ring->tail, &ring->tail_waiting);
+    }
+}
+
+// Reading from the previous stage
+// blocks until a key arrives, -1 once the previous stage has stopped and everything is read or the guest is stopped
+int ring_read(struct ring* ring){
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail;
+    while ((tail = atomic_load(&ring->tail)) == head) {
+        if (atomic_load(&ring->closed) && atomic_load(&ring->tail) == head) {
+            return -1;
+        }
+        // the watchdog stopped the guest while it waited, ring_wait wakes up often enough to notice
+        if (!running) {
+            return -1;
+        }
+        ring_wait(&ring->tail, &ring->tail_waiting, tail);
+    }
+    char c = ring->data[head % RING_SIZE];
+    atomic_store(&ring->head, head + 1);
+    // a writer blocked on a full ring is only woken once there is room for a good chunk
+    if (tail - (head + 1) <= RING_SIZE / 2) {
+        ring_wake(&ring->head, &ring->head_waiting);
+    }
+    return (uint8_t)c;
+}
+
+// Closing a stage's rings
+// lets the neighbouring stages finish instead of waiting on this one
+void close_ring(struct ring* ring, int writer){
+    if (!ring) return;
+    if (writer) {
+        atomic_store(&ring->closed, 1);
+        syscall(SYS_futex, &ring->tail, FUTEX_WAKE, 1, NULL, NULL, 0);
+    } else {
+        atomic_store(&ring->reader_closed, 1);
+        syscall(SYS_futex, &ring->head, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+void close_rings(){
+    close_ring(out_ring, 1);
+    close_ring(out_chan, 1);
+    close_ring(in_ring, 0);
+    close_ring(in_chan, 0);
+}
+
+// Closing another stage's rings
+// the rings are shared, so stage 0 can close them for a stage that died without doing it itself
+void close_stage_rings(int n){
+    struct ring* chans = pipeline_rings + (stage_count - 1);
+    if (n > 0) {
+        close_ring(&pipeline_rings[n - 1], 0);
+        close_ring(&chans[n - 1], 0);
+    }
+    if (n < stage_count - 1) {
+        close_ring(&pipeline_rings[n], 1);
+        close_ring(&chans[n], 1);
+    }
+}
+
+// SIGCHLD in stage 0
+// however a later stage ended, SIGKILL and the OOM killer included, its neighbours stop waiting on it
+// the stage is left unreaped for wait_pipeline() to collect its status
+void handle_stage_exit(int sig){
+    int saved_errno = errno;
+    for (int n = 1; n < stage_count; n++) {
+        siginfo_t info;
+        info.si_pid = 0;
+        if (waitid(P_PID, stage_pids[n], &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid) {
+            close_stage_rings(n);
+        }
+    }
+    errno = saved_errno;
+}
+
+// SIGINT and SIGTERM let the neighbouring stages finish before proto exits
+void handle_interrupt(int signal){
+    close_rings();
+    restore_input_buffering();
+    printf("\n");
+    exit(-2);
+}
+
+// Crashes write a postmortem unless one was just written, then die as they would have
+// the rings are closed first so the neighbouring stages aren't left waiting on this one
+void handle_crash(int sig){
+    if (!postmortem_written) {
+        write_postmortem(PM_SIGNAL, sig);
+    }
+    close_rings();
+    restore_input_buffering();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+// Channel status
+// a word is two bytes in the channel ring
+uint16_t chan_status(){
+    uint16_t status = 0;
+    if (in_chan) {
+        uint32_t used = atomic_load(&in_chan->tail) - atomic_load(&in_chan->head);
+        if (used >= 2) {
+            status |= CH_RX_READY;
+        } else if (used == 0 && atomic_load(&in_chan->closed) && atomic_load(&in_chan->tail) == atomic_load(&in_chan->head)) {
+            status |= CH_RX_CLOSED;
+        }
+    }
+    if (out_chan && !atomic_load(&out_chan->reader_closed)) {
+        uint32_t used = atomic_load(&out_chan->tail) - atomic_load(&out_chan->head);
+        if (RING_SIZE - used >= 2) {
+            status |= CH_TX_READY;
+        }
+    }
+    return status;
+}
+
+// Sending a word
+// blocks while the channel is full, dropped when there is no next stage
+void chan_send(uint16_t val){
+    if (!out_chan) return;
+    char bytes[2] = { val & 0xFF, val >> 8 };
+    ring_write(out_chan, bytes, 2);
+}
+
+// Receiving a word
+// blocks until a word arrives, 0 when there is no previous stage or it has stopped
+uint16_t chan_receive(){
+    if (!in_chan) return 0;
+    int low = ring_read(in_chan);
+    int high = low < 0 ? -1 : ring_read(in_chan);
+    if (high < 0) return 0;
+    return low | (high << 8);
+}
+
+// Pinning a stage
+// puts stage n on the n-th core the process is allowed to run on
+void pin_stage(int n){
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+    int k = n % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && k-- == 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            sched_setaffinity(0, sizeof(set), &set);
+            return;
+        }
+    }
+}
+
+// Starting the pipeline
+// forks a process for every stage after the first, the caller carries on as stage 0
+int start_pipeline(){
+    // a keyboard ring and a channel for every link
+    size_t size = sizeof(struct ring) * (stage_count - 1) * 2;
+    struct ring* rings = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (rings == MAP_FAILED) return 0;
+    pipeline_rings = rings;
+    signal(SIGCHLD, handle_stage_exit);
+    // held back until every pid is known, so a stage that dies straight away isn't missed
+    sigset_t chld, old_mask;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &old_mask);
+    pid_t first = getpid();
+    for (int n = 1; n < stage_count; n++) {
+        pid_t pid = fork();
+        if (pid < 0) return 0;
+        if (pid == 0) {
+            stage = n;
+            signal(SIGCHLD, SIG_DFL);
+            // stage 0 can't close the rings for itself if it is killed, this stage goes with it
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            if (getppid() != first) {
+                _exit(1);
+            }
+            break;
+        }
+        stage_pids[n] = pid;
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    struct ring* chans = rings + (stage_count - 1);
+    in_ring = stage > 0 ? &rings[stage - 1] : NULL;
+    out_ring = stage < stage_count - 1 ? &rings[stage] : NULL;
+    in_chan = stage > 0 ? &chans[stage - 1] : NULL;
+    out_chan = stage < stage_count - 1 ? &chans[stage] : NULL;
+    pin_stage(stage);
+    return 1;
+}
+
+// Waiting for the pipeline
+// the exit status of the first later stage that didn't finish cleanly, 0 if they all did
+int wait_pipeline(){
+    int result = 0;
+    for (int n = 1; n < stage_count; n++) {
+        int status;
+        if (waitpid(stage_pids[n], &status, 0) < 0 || !WIFEXITED(status)) {
+            status = 1;
+        } else {
+            status = WEXITSTATUS(status);
+        }
+        if (!result) {
+            result = status;
+        }
+    }
+    return result;
+}
+
+// Output buffer
+// big enough for a PUTSP string that spans all of memory
+char out_buffer[2 * MAX_MEMORY];
+
+// Output
+// the string traps hand their whole string over in one write
+void out_write(const char* buf, size_t len){
+    guest_busy = 1;
+    if (out_ring) {
+        ring_write(out_ring, buf, len);
+        return;
+    }
+    fwrite(buf, 1, len, stdout);
+    if (script_file) {
+        script_output(buf, len);
+    }
+}
+
+void out_char(char c){
+    out_write(&c, 1);
+}
+
+// Narrowing a string for TRAP_PUTS
+// one character per word, up to the terminating zero word or the end of memory
+size_t narrow_string(uint16_t address, char* out){
+    const uint16_t* c = memory + address;
+    size_t n = 0;
+    size_t max = MAX_MEMORY - address;
+#ifdef __SSE2__
+    // 8 words at a time, until a chunk holds the terminating zero
+    const __m128i low = _mm_set1_epi16(0xFF);
+    const __m128i zero = _mm_setzero_si128();
+    while (n + 8 <= max) {
+        __m128i words = _mm_loadu_si128((const __m128i*)(c + n));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(words, zero))) break;
+        __m128i bytes = _mm_packus_epi16(_mm_and_si128(words, low), zero);
+        _mm_storel_epi64((__m128i*)(out + n), bytes);
+        n += 8;
+    }
+#endif
+    while (n < max && c[n]) {
+        out[n] = (char)c[n];
+        ++n;
+    }
+    return n;
+}
+
+// Unpacking a string for TRAP_PUTSP
+// two characters per word, low byte first, a zero high byte is skipped
+size_t unpack_string(uint16_t address, char* out){
+    const uint16_t* c = memory + address;
+    size_t i = 0;
+    size_t n = 0;
+    size_t max = MAX_MEMORY - address;
+#ifdef __SSE2__
+    // x86 is little-endian, so 8 words with no zero high byte are already the 16 characters in order
+    const __m128i high = _mm_set1_epi16((short)0xFF00);
+    const __m128i zero = _mm_setzero_si128();
+    while (i + 8 <= max) {
+        __m128i words = _mm_loadu_si128((const __m128i*)(c + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(words, high), zero))) break;
+        _mm_storeu_si128((__m128i*)(out + n), words);
+        i += 8;
+        n += 16;
+    }
+#endif
+    while (i < max && c[i]) {
+        out[n++] = c[i] & 0xFF;
+        if (c[i] >> 8) out[n++] = c[i] >> 8;
+        ++i;
+    }
+    return n;
+}
+
+// Opening the hardware counters
+// user space only so it works under the default perf_event_paranoid, counters the host lacks stay at -1
+void open_hwcounters(){
+    const uint64_t cache_miss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    const uint32_t types[HW_COUNT] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+        PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE,
+    };
+    const uint64_t configs[HW_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_HW_CACHE_L1I | cache_miss, PERF_COUNT_HW_CACHE_L1D | cache_miss, PERF_COUNT_HW_CACHE_DTLB | cache_miss,
+    };
+    for (int i = 0; i < HW_COUNT; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[i];
+        attr.config = configs[i];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // the PMU may time share more events than it has counters, so each count comes with its share
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        hw_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+}
+
+// Starting or stopping the hardware counters
+void enable_hwcounters(int enable){
+    for (int i = 0; i < HW_COUNT; i++) {
+        if (hw_fds[i] >= 0) {
+            ioctl(hw_fds[i], enable ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+}
+
+// Printing the hardware counters
+// next to the guest instruction count, with the per guest instruction rates derived from them
+// a multiplexed counter is scaled up to the whole run and says how much of it it saw
+void print_hwcounters(){
+    uint64_t values[HW_COUNT];
+    int valid[HW_COUNT];
+    for (int i = 0; i < HW_COUNT; i++) {
+        uint64_t sample[3]; // value, time enabled, time running
+        valid[i] = hw_fds[i] >= 0 && read(hw_fds[i], sample, sizeof(sample)) == sizeof(sample) && sample[2] > 0;
+        if (!valid[i]) {
+            fprintf(stderr, "%s : %s\n", hw_names[i], hw_fds[i] >= 0 ? "never scheduled" : "not supported");
+            continue;
+        }
+        if (sample[2] < sample[1]) {
+            values[i] = (uint64_t)((double)sample[0] * sample[1] / sample[2]);
+            fprintf(stderr, "%s : %llu (scaled, counted %.0f%% of the run)\n", hw_names[i],
+                    (unsigned long long)values[i], 100.0 * sample[2] / sample[1]);
+        } else {
+            values[i] = sample[0];
+            fprintf(stderr, "%s : %llu\n", hw_names[i], (unsigned long long)values[i]);
+        }
+    }
+    double guest = instr_count ? (double)instr_count : 1.0;
+    fprintf(stderr, "guest instructions : %llu\n", (unsigned long long)instr_count);
+    if (valid[HW_CYCLES]) {
+        fprintf(stderr, "host cycles per guest instruction : %.2f\n", values[HW_CYCLES] / guest);
+    }
+    if (valid[HW_INSTRUCTIONS]) {
+        fprintf(stderr, "host instructions per guest instruction : %.2f\n", values[HW_INSTRUCTIONS] / guest);
+    }
+    if (valid[HW_BRANCH_MISSES]) {
+        fprintf(stderr, "branch misses per guest instruction : %.4f\n", values[HW_BRANCH_MISSES] / guest);
+    }
+}
+
+// Instruction shape
+// index into shape_names for the profile
+int instr_shape(uint16_t instr){
+    uint16_t op = instr >> 12;
+    uint16_t mode = 0;
+    if (op == OP_ADD || op == OP_AND) {
+        mode = (instr >> 5) & 0x1;
+    } else if (op == OP_JSR) {
+        mode = (instr >> 11) & 0x1;
+    }
+    return op * 2 + mode;
+}
+
+int shape_index(const char* name){
+    for (int i = 0; i < SHAPE_COUNT; i++) {
+        if (shape_names[i] && strcmp(shape_names[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+// Profiling an instruction
+// counts the pair and triple ending at this instruction
+void profile_instr(uint16_t instr){
+    int shape = instr_shape(instr);
+    int prev1 = shape_history[1];
+    int prev2 = shape_history[0];
+    if (prev1 >= 0) {
+        bigrams[prev1][shape]++;
+        if (prev2 >= 0) {
+            trigrams[prev2][prev1][shape]++;
+        }
+    }
+    shape_history[0] = prev1;
+    shape_history[1] = shape;
+    ++profile_instrs;
+}
+
+// Loading a profile
+// an existing profile file is added to, so runs over several images accumulate
+void load_profile(const char* path){
+    FILE* file = fopen(path, "r");
+    if (!file) return;
+    char line[128], a[16], b[16], c[16];
+    unsigned long long n;
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "instructions %llu", &n) == 1) {
+            profile_instrs += n;
+        } else if (sscanf(line, "bigram %15s %15s %llu", a, b, &n) == 3) {
+            int i = shape_index(a), j = shape_index(b);
+            if (i >= 0 && j >= 0) bigrams[i][j] += n;
+        } else if (sscanf(line, "trigram %15s %15s %15s %llu", a, b, c, &n) == 4) {
+            int i = shape_index(a), j = shape_index(b), k = shape_index(c);
+            if (i >= 0 && j >= 0 && k >= 0) trigrams[i][j][k] += n;
+        }
+    }
+    fclose(file);
+}
+
+struct profile_entry {
+    uint64_t count;
+    int shapes[3];
+};
+
+int compare_entries(const void* a, const void* b){
+    uint64_t x = ((const struct profile_entry*)a)->count;
+    uint64_t y = ((const struct profile_entry*)b)->count;
+    return (x < y) - (x > y);
+}
+
+// Reporting the top n-grams
+// coverage is the share of instructions inside them, fusing each one would save n - 1 dispatches
+// overlapping occurrences can't all be fused, so the saving is an upper bound
+void report_ngrams(struct profile_entry* entries, size_t count, int n){
+    qsort(entries, count, sizeof(*entries), compare_entries);
+    double instrs = profile_instrs ? (double)profile_instrs : 1.0;
+    uint64_t total = 0;
+    fprintf(stderr, "top %d-grams :\n", n);
+    for (size_t i = 0; i < count && i < PROFILE_TOP; i++) {
+        fprintf(stderr, " ");
+        for (int k = 0; k < n; k++) {
+            fprintf(stderr, " %-5s", shape_names[entries[i].shapes[k]]);
+        }
+        fprintf(stderr, " %llu (%.1f%%)\n", (unsigned long long)entries[i].count, entries[i].count * n / instrs * 100);
+        total += entries[i].count;
+    }
+    // each instruction can only be part of one fused handler
+    double coverage = total * n / instrs * 100;
+    double saved = total * (n - 1) / instrs * 100;
+    double max_saved = (n - 1) * 100.0 / n;
+    fprintf(stderr, "coverage : %.1f%%, dispatches saved : up to %.1f%%\n",
+            coverage > 100 ? 100 : coverage, saved > max_saved ? max_saved : saved);
+}
+
+// Saving a profile
+// writes the raw counts to the profile file and the top n-grams to stderr
+void save_profile(const char* path){
+    static struct profile_entry entries[SHAPE_COUNT * SHAPE_COUNT * SHAPE_COUNT];
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "ERROR : failed to write profile %s\n", path);
+        return;
+    }
+    fprintf(file, "instructions %llu\n", (unsigned long long)profile_instrs);
+
+    size_t count = 0;
+    for (int i = 0; i < SHAPE_COUNT; i++) {
+        for (int j = 0; j < SHAPE_COUNT; j++) {
+            if (!bigrams[i][j]) continue;
+            fprintf(file, "bigram %s %s %llu\n", shape_names[i], shape_names[j], (unsigned long long)bigrams[i][j]);
+            entries[count++] = (struct profile_entry){ bigrams[i][j], { i, j, 0 } };
+        }
+    }
+    fprintf(stderr, "profile : %llu instructions\n", (unsigned long long)profile_instrs);
+    report_ngrams(entries, count, 2);
+
+    count = 0;
+    for (int i = 0; i < SHAPE_COUNT; i++) {
+        for (int j = 0; j < SHAPE_COUNT; j++) {
+            for (int k = 0; k < SHAPE_COUNT; k++) {
+                if (!trigrams[i][j][k]) continue;
+                fprintf(file, "trigram %s %s %s %llu\n", shape_names[i], shape_names[j], shape_names[k], (unsigned long long)trigrams[i][j][k]);
+                entries[count++] = (struct profile_entry){ trigrams[i][j][k], { i, j, k } };
+            }
+        }
+    }
+    report_ngrams(entries, count, 3);
     fclose(file);
+}
+
+// Releasing memory
+// drops the whole pages inside a buffer, they read back as zeroes
+void release_pages(void* buf, size_t size){
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)buf + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t)buf + size) & ~(page - 1);
+    if (end > start) {
+        madvise((void*)start, end - start, MADV_DONTNEED);
+    }
+}
+
+// Packing memory
+// word level run length coding for snapshots, all of memory in order as records of a header word
+// and either one word repeated (header & 0x7FFF) times when bit 15 is set, or that many literal words
+int pack_memory(FILE* file){
+    enum{ MIN_REPEAT = 3, MAX_RECORD = 0x7FFF };
+    uint32_t address = 0;
+    while (address < MAX_MEMORY) {
+        uint32_t run = 1;
+        while (address + run < MAX_MEMORY && run < MAX_RECORD && memory[address + run] == memory[address]) {
+            ++run;
+        }
+        if (run >= MIN_REPEAT) {
+            uint16_t record[2] = { 0x8000 | run, memory[address] };
+            if (fwrite(record, sizeof(record), 1, file) != 1) return 0;
+            address += run;
+            continue;
+        }
+        // literals up to where the next repeat starts
+        uint32_t end = address + 1;
+        while (end < MAX_MEMORY && end - address < MAX_RECORD) {
+            if (end + 2 < MAX_MEMORY && memory[end] == memory[end + 1] && memory[end] == memory[end + 2]) break;
+            ++end;
+        }
+        uint16_t header = end - address;
+        if (fwrite(&header, sizeof(header), 1, file) != 1 || fwrite(memory + address, sizeof(uint16_t), header, file) != header) {
+            return 0;
+        }
+        address = end;
+    }
     return 1;
 }
 
+// Unpacking memory
+// the inverse of pack_memory(), 0 if the records are cut short or don't add up to all of memory
+int unpack_memory(FILE* file){
+    uint32_t address = 0;
+    while (address < MAX_MEMORY) {
+        uint16_t header;
+        if (fread(&header, sizeof(header), 1, file) != 1) return 0;
+        uint32_t n = header & 0x7FFF;
+        if (n == 0 || address + n > MAX_MEMORY) return 0;
+        if (header & 0x8000) {
+            uint16_t word;
+            if (fread(&word, sizeof(word), 1, file) != 1) return 0;
+            for (uint32_t i = 0; i < n; i++) {
+                memory[address + i] = word;
+            }
+        } else if (fread(memory + address, sizeof(uint16_t), n, file) != n) {
+            return 0;
+        }
+        address += n;
+    }
+    return 1;
+}
+
+// Hibernating
+// returns the snapshot, -1 if it couldn't be written and the guest stays as it is
+int hibernate(){
+    int fd;
+    if (hibernate_dir) {
+        snprintf(snapshot_path, sizeof(snapshot_path), "%s/proto-%d.snap", hibernate_dir, (int)getpid());
+        fd = open(snapshot_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    } else {
+        fd = memfd_create("proto-snapshot", 0);
+    }
+    if (fd < 0) return -1;
+    int copy = dup(fd);
+    FILE* file = copy >= 0 ? fdopen(copy, "w") : NULL;
+    int ok = file != NULL
+             && fwrite(registers, sizeof(registers), 1, file) == 1
+             && fwrite(&flag_value, sizeof(flag_value), 1, file) == 1
+             && pack_memory(file);
+    for (int i = 0; ok && i < device_count; i++) {
+        if (devices[i].save) {
+            ok = devices[i].save(devices[i].context, file);
+        }
+    }
+    if (ok) {
+        snapshot_bytes = ftell(file);
+    }
+    if (file && fclose(file) != 0) {
+        ok = 0;
+    } else if (!file && copy >= 0) {
+        close(copy);
+    }
+    if (!ok) {
+        close(fd);
+        if (hibernate_dir) unlink(snapshot_path);
+        return -1;
+    }
+    release_pages(memory, sizeof(memory));
+    release_pages(out_buffer, sizeof(out_buffer));
+    ++hibernations;
+    return fd;
+}
+
+// Thawing
+// puts the guest back exactly as it was written, there is no way to carry on if that fails
+void thaw(int fd){
+    lseek(fd, 0, SEEK_SET);
+    FILE* file = fdopen(fd, "r");
+    int ok = file && fread(registers, sizeof(registers), 1, file) == 1
+             && fread(&flag_value, sizeof(flag_value), 1, file) == 1
+             && unpack_memory(file);
+    for (int i = 0; ok && i < device_count; i++) {
+        if (devices[i].restore) {
+            ok = devices[i].restore(devices[i].context, file);
+        }
+    }
+    if (file) {
+        fclose(file);
+    } else {
+        close(fd);
+    }
+    if (hibernate_dir) {
+        unlink(snapshot_path);
+    }
+    if (!ok) {
+        restore_input_buffering();
+        fprintf(stderr, "ERROR : failed to thaw the guest\n");
+        exit(1);
+    }
+}
+
+// Waiting for a key
+// on the terminal, up to timeout milliseconds or for ever when it is -1
+int wait_key(int timeout){
+    struct pollfd stdin_poll = { STDIN_FILENO, POLLIN, 0 };
+    return poll(&stdin_poll, 1, timeout) > 0;
+}
+
+// Sleeping through idleness
+// hibernates, waits for the key that wakes the guest and thaws, 0 if the guest was stopped meanwhile
+int hibernate_until_key(){
+    int fd = hibernate();
+    while (running && !wait_key(-1)) {
+    }
+    if (fd >= 0) {
+        thaw(fd);
+    }
+    return running;
+}
+
+// Checking for a key
+// from the previous stage with --pipe, the script's key queue with --script, the terminal otherwise
+// input that has run out ends the run instead of leaving the guest polling forever
+uint16_t key_ready(){
+    if (in_ring) {
+        if (atomic_load(&in_ring->head) != atomic_load(&in_ring->tail)) {
+            return 1;
+        }
+        if (atomic_load(&in_ring->closed) && atomic_load(&in_ring->head) == atomic_load(&in_ring->tail)) {
+            running = 0;
+        }
+        return 0;
+    }
+    if (!script_file) {
+        if (check_key()) {
+            return 1;
+        }
+        if (hibernate_seconds) {
+            // only a guest spinning on KBSR is idle, one that polls between bursts of computing or printing is not
+            int spinning = registers[R_PC] == poll_pc && instr_count - poll_count <= POLL_LOOP;
+            poll_pc = registers[R_PC];
+            poll_count = instr_count;
+            if (guest_busy || !spinning) {
+                guest_busy = 0;
+                idle_since = time(NULL);
+            } else if (time(NULL) - idle_since >= hibernate_seconds) {
+                return hibernate_until_key();
+            }
+        }
+        return 0;
+    }
+    if (key_head != key_tail) {
+        return 1;
+    }
+    if (!expecting) {
+        running = 0;
+    }
+    return 0;
+}
+
+// Reading a key
+// blocks on the terminal or the previous stage, a script with nothing queued can't unblock the guest
+uint16_t read_key(){
+    if (in_ring) {
+        int c = ring_read(in_ring);
+        if (c < 0) {
+            running = 0;
+            return 0;
+        }
+        return c;
+    }
+    if (!script_file) {
+        // stdio only flushes before a read on a line buffered stdin, not the unbuffered one --hibernate uses
+        fflush(stdout);
+        if (hibernate_seconds && !wait_key(hibernate_seconds * 1000) && (!running || !hibernate_until_key())) {
+            return 0;
+        }
+        idle_since = time(NULL);
+        // SIGALRM interrupts the read rather than restarting it, so the watchdog can stop a waiting guest
+        int c = getchar();
+        if (!running) {
+            return 0;
+        }
+        return (uint16_t)c;
+    }
+    if (key_head != key_tail) {
+        return (uint8_t)key_queue[key_head++ % KEY_QUEUE_SIZE];
+    }
+    if (expecting) {
+        script_fail("guest is waiting for input before the expected output");
+    } else {
+        running = 0;
+    }
+    return 0;
+}
+
+// DMA copy
+// moves MR_DMALR words from MR_DMASR to MR_DMADR as one memmove, overlapping ranges are fine
+// ranges that run past the top of memory wrap around like the guest's own addresses would,
+// they can overlap at both ends so they go through a bounce buffer
+void dma_copy(){
+    static uint16_t bounce[MAX_MEMORY];
+    uint16_t src = memory[MR_DMASR];
+    uint16_t dst = memory[MR_DMADR];
+    uint16_t len = memory[MR_DMALR];
+    if (src + len <= MAX_MEMORY && dst + len <= MAX_MEMORY) {
+        memmove(memory + dst, memory + src, len * sizeof(uint16_t));
+    } else {
+        for (uint16_t i = 0; i < len; i++) {
+            bounce[i] = memory[(uint16_t)(src + i)];
+        }
+        for (uint16_t i = 0; i < len; i++) {
+            memory[(uint16_t)(dst + i)] = bounce[i];
+        }
+    }
+    memory[MR_DMACR] = DMA_DONE;
+}
+
+// Reading a counter
+// reading the low word latches the whole 32-bit value, so the high word read next matches it
+void read_counter(uint16_t address){
+    uint64_t value;
+    if (address == MR_ICLO) {
+        value = instr_count;
+    } else if (address == MR_CYLO) {
+        value = cycle_count;
+    } else {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        value = (now.tv_sec - run_start.tv_sec) * 1000000000ull + now.tv_nsec - run_start.tv_nsec;
+    }
+    memory[address] = value & 0xFFFF;
+    memory[address + 2] = (value >> 16) & 0xFFFF;
+}
+
+// Reading device registers
+// refreshes a memory mapped register before the guest reads it
+void io_read(uint16_t address){
+    switch (address) {
+        case MR_KBSR:
+            if (key_ready()) {
+                memory[MR_KBSR] = (1 << 15);
+                memory[MR_KBDR] = read_key();
+            } else {
+                memory[MR_KBSR] = 0;
+                // a guest polling for a key should see what it has echoed so far
+                fflush(stdout);
+            }
+            break;
+        case MR_CHSR:
+            memory[MR_CHSR] = chan_status();
+            break;
+        case MR_CHRX:
+            memory[MR_CHRX] = chan_receive();
+            break;
+        case MR_ICLO:
+        case MR_CYLO:
+        case MR_NSLO:
+            read_counter(address);
+            break;
+        default:
+            if (address >= PROTO_DEVICE_FIRST) {
+                struct proto_device* device = device_map[address - PROTO_DEVICE_FIRST];
+                if (device && device->read) {
+                    memory[address] = device->read(device->context, address);
+                }
+            }
+            break;
+    }
+}
+
+// Writing device registers
+void io_write(uint16_t address, uint16_t val){
+    memory[address] = val;
+    guest_busy = 1;
+    switch (address) {
+        case MR_CHTX:
+            chan_send(val);
+            break;
+        case MR_DMACR:
+            if (val & DMA_START) {
+                dma_copy();
+            }
+            break;
+        default:
+            if (address >= PROTO_DEVICE_FIRST) {
+                struct proto_device* device = device_map[address - PROTO_DEVICE_FIRST];
+                if (device && device->write) {
+                    device->write(device->context, address, val);
+                }
+            }
+            break;
+    }
+}
+
 // Writing to memory
 void mem_write(uint16_t address, uint16_t val){
+    if (address >= IO_PAGE) {
+        io_write(address, val);
+        return;
+    }
     memory[address] = val;
 }
 
 // Reading from memory
 uint16_t mem_read(uint16_t address){
-    if (address == MR_KBSR) {
-        if (check_key()) {
-            memory[MR_KBSR] = (1 << 15);
-            memory[MR_KBDR] = getchar();
-        } else {
-            memory[MR_KBSR] = 0;
-        }
+    if (address >= IO_PAGE) {
+        io_read(address);
     }
     return memory[address];
 }
 // Main function
 int main(int argc, char *argv[])
 {
+    // Parsing the options, everything else is an image file
+    const char* cpu_list = NULL;
+    int show_stats = 0;
+    const char* profile_path = NULL;
+    int show_hwcounters = 0;
+    const char* script_path = NULL;
+    const char* dump_path = NULL;
+    const char* postmortem_view = NULL;
+    const char* symbols_path = NULL;
+    const char* plugin_paths[MAX_PLUGINS];
+    int plugin_count = 0;
+    int image_count = 0;
+    int image_stage[argc];
+    for (int j = 1; j < argc; j++) {
+        if (strcmp(argv[j], "--cpus") == 0 && j + 1 < argc) {
+            cpu_list = argv[++j];
+        } else if (strcmp(argv[j], "--stats") == 0) {
+            show_stats = 1;
+        } else if (strcmp(argv[j], "--hwcounters") == 0) {
+            show_hwcounters = 1;
+        } else if (strcmp(argv[j], "--dump") == 0 && j + 1 < argc) {
+            dump_path = argv[++j];
+        } else if (strcmp(argv[j], "--watchdog") == 0 && j + 1 < argc) {
+            watchdog_seconds = atoi(argv[++j]);
+        } else if (strcmp(argv[j], "--postmortem") == 0 && j + 1 < argc) {
+            postmortem_view = argv[++j];
+        } else if (strcmp(argv[j], "--symbols") == 0 && j + 1 < argc) {
+            symbols_path = argv[++j];
+        } else if (strcmp(argv[j], "--hibernate") == 0 && j + 1 < argc) {
+            hibernate_seconds = atoi(argv[++j]);
+        } else if (strcmp(argv[j], "--hibernate-dir") == 0 && j + 1 < argc) {
+            hibernate_dir = argv[++j];
+        } else if (strcmp(argv[j], "--script") == 0 && j + 1 < argc) {
+            script_path = argv[++j];
+        } else if (strcmp(argv[j], "--profile") == 0 && j + 1 < argc) {
+            profile_path = argv[++j];
+        } else if (strcmp(argv[j], "--plugin") == 0 && j + 1 < argc && plugin_count < MAX_PLUGINS) {
+            plugin_paths[plugin_count++] = argv[++j];
+        } else if (strcmp(argv[j], "--pipe") == 0 && stage_count < MAX_STAGES) {
+            ++stage_count;
+        } else if (strncmp(argv[j], "--", 2) == 0) {
+            printf("ERROR : unknown option %s\n", argv[j]);
+            exit(1);
+        } else {
+            image_stage[1 + image_count] = stage_count - 1;
+            argv[1 + image_count++] = argv[j];
+        }
+    }
+
+    // Viewing a postmortem instead of running
+    if (postmortem_view) {
+        if (!show_postmortem(postmortem_view, symbols_path)) {
+            printf("ERROR : failed to read postmortem %s\n", postmortem_view);
+            exit(1);
+        }
+        exit(0);
+    }
+
     // Show the usage of the command
-    if (argc < 2) {
-        printf("proto [image-file1]...\n");
+    if (image_count < 1) {
+        printf("proto --postmortem file [--symbols file]\n");
+        printf("proto [--cpus list] [--dump file] [--watchdog seconds] [--hibernate seconds] [--hibernate-dir dir] [--stats] [--hwcounters] [--profile file] [--script file] [--plugin file] [image-file1]... [--pipe image-file1...]...\n");
+        exit(1);
+    }
+
+    if (stage_count > 1) {
+        // every stage needs its own images
+        for (int n = 0; n < stage_count; n++) {
+            int found = 0;
+            for (int j = 1; j <= image_count; j++) {
+                found |= image_stage[j] == n;
+            }
+            if (!found) {
+                printf("ERROR : pipeline stage %d has no image\n", n + 1);
+                exit(1);
+            }
+        }
+        if (script_path || profile_path) {
+            printf("ERROR : --script and --profile can't be used with --pipe\n");
+            exit(1);
+        }
+    }
+
+    if (cpu_list && !pin_cpus(cpu_list)) {
+        printf("ERROR : invalid cpu list %s\n", cpu_list);
         exit(1);
     }
 
+    for (int j = 0; j < plugin_count; j++) {
+        if (!load_plugin(plugin_paths[j])) {
+            printf("ERROR : failed to load plugin %s\n", plugin_paths[j]);
+            exit(1);
+        }
+    }
+
+    // Starting the stages once every image is known to be there
+    // each stage then loads its own, so its memory is first touched on its own core
+    if (stage_count > 1) {
+        for (int j = 1; j <= image_count; j++) {
+            if (access(argv[j], R_OK) != 0) {
+                printf("ERROR : failed to load image %s\n", argv[j]);
+                exit(1);
+            }
+        }
+        if (!start_pipeline()) {
+            printf("ERROR : failed to start the pipeline\n");
+            exit(1);
+        }
+    }
+
     // Checking if all given image files are valid
-    for (int j = 1; j < argc; j++) {
+    for (int j = 1; j <= image_count; j++) {
+        if (image_stage[j] != stage) continue;
         if (!read_image(argv[j])) {
             printf("ERROR : failed to load image %s\n", argv[j]);
             exit(1);
         }
     }
 
+    if (script_path) {
+        script_file = fopen(script_path, "r");
+        if (!script_file) {
+            printf("ERROR : failed to open script %s\n", script_path);
+            exit(1);
+        }
+    }
+
+    // Each stage writes its own postmortem
+    if (dump_path && stage_count > 1) {
+        snprintf(postmortem_path, sizeof(postmortem_path), "%s.%d", dump_path, stage + 1);
+    } else if (dump_path) {
+        snprintf(postmortem_path, sizeof(postmortem_path), "%s", dump_path);
+    } else {
+        snprintf(postmortem_path, sizeof(postmortem_path), "proto-%d.pm", (int)getpid());
+    }
+
     signal(SIGINT, handle_interrupt);
-    disable_input_buffering();
+    signal(SIGTERM, handle_interrupt);
+    signal(SIGUSR2, handle_dump_request);
+    signal(SIGABRT, handle_crash);
+    signal(SIGSEGV, handle_crash);
+    signal(SIGBUS, handle_crash);
+    signal(SIGFPE, handle_crash);
+    signal(SIGILL, handle_crash);
+    if (!script_file && stage == 0) {
+        disable_input_buffering();
+    }
+    if (hibernate_seconds) {
+        // keys must not sit in stdio's buffer where poll() can't see them
+        setvbuf(stdin, NULL, _IONBF, 0);
+        idle_since = time(NULL);
+    }
 
     // TODO: Setup
 
     // Initializing the condition flag to zero
+    flag_value = 0;
     registers[R_COND] = FL_ZRO;
 
     // Setting the PC up to starting position
     enum{ PC_START = 0x3000 };
     registers[R_PC] = PC_START;
 
-    int running = 1;
+    if (profile_path) {
+        load_profile(profile_path);
+    }
+
+    if (show_hwcounters) {
+        open_hwcounters();
+        enable_hwcounters(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &run_start);
+    if (watchdog_seconds) {
+        // no SA_RESTART, a guest blocked on input has to come back to the main loop to stop
+        struct sigaction watchdog = { 0 };
+        watchdog.sa_handler = handle_watchdog;
+        sigemptyset(&watchdog.sa_mask);
+        sigaction(SIGALRM, &watchdog, NULL);
+        alarm(watchdog_seconds);
+    }
+
+    if (script_file) {
+        script_advance();
+    }
+
+    running = 1;
     while (running) {
         // Get the next operation
         uint16_t instr = mem_read(registers[R_PC]++);
+        ++instr_count;
+        trace[instr_count % TRACE_SIZE] = (uint32_t)(registers[R_PC] - 1) << 16 | instr;
+        cycle_count += op_cycles[instr >> 12];
+        if (profile_path) {
+            profile_instr(instr);
+        }
+        // an expect times out however the guest spends its instructions, printing, polling or computing
+        if (expecting && instr_count > expect_deadline) {
+            script_fail("expected output did not appear");
+        }
         uint16_t op = instr >> 12;
 
+        // devices tick at block boundaries, every branch, jump and trap
+        if (device_ticks && (op == OP_BR || op == OP_JMP || op == OP_JSR || op == OP_TRAP)) {
+            tick_devices();
+        }
+
         uint16_t r0, r1, r2, imm_flag, pc_offset;
-        uint16_t* c;
         // Switch case to handle the operation input
         switch (op) {
             case OP_ADD:
@@ -256,7 +2004,7 @@ int main(int argc, char *argv[])
             case OP_BR:
                 pc_offset = sign_extend(instr & 0x1FF, 9);
                 uint16_t cond_flag = (instr >> 9) & 0x7;
-                if (cond_flag & registers[R_COND]) {
+                if (cond_flag & cond_flags()) {
                     registers[R_PC] += pc_offset;
                 }
                 break;
@@ -281,7 +2029,7 @@ int main(int argc, char *argv[])
             case OP_LDI:
                 r0 = (instr >> 9) & 0x7; // Destination register
                 pc_offset = sign_extend(instr & 0x1FF, 9);
-                r0 = mem_read(mem_read(registers[R_PC] + pc_offset));
+                registers[r0] = mem_read(mem_read(registers[R_PC] + pc_offset));
                 update_flags(r0);
                 break;
             case OP_LDR:
@@ -317,52 +2065,100 @@ int main(int argc, char *argv[])
                 registers[R_R7] = registers[R_PC];
                 switch (instr & 0xFF) {
                     case TRAP_GETC:
-                        registers[R_R0] = (uint16_t)getchar();
+                        registers[R_R0] = read_key();
                         update_flags(R_R0);
                         break;
                     case TRAP_OUT:
-                        putc((char)registers[R_R0], stdout);
+                        out_char((char)registers[R_R0]);
                         break;
                     case TRAP_PUTS:
-                        c = memory + registers[R_R0];
-                        while (*c) {
-                            putc((char)*c, stdout);
-                            ++c;
-                        }
+                        out_write(out_buffer, narrow_string(registers[R_R0], out_buffer));
                         fflush(stdout);
                         break;
                     case TRAP_IN:
-                        printf("Enter a character : ");
-                        char in_c = getchar();
-                        putc(in_c, stdout);
+                        out_write("Enter a character : ", 20);
+                        char in_c = read_key();
+                        // stopped while waiting, there is no key to echo
+                        if (!running) {
+                            fflush(stdout);
+                            break;
+                        }
+                        out_char(in_c);
                         fflush(stdout);
                         registers[R_R0] = (uint16_t)in_c;
                         update_flags(R_R0);
                         break;
                     case TRAP_PUTSP:
-                        c = memory + registers[R_R0];
-                        while (*c) {
-                            char char1 = (*c) & 0xFF;
-                            putc(char1, stdout);
-                            char char2 = (*c) >> 8;
-                            if (char2) putc(char2, stdout);
-                            ++c;
-                        }
+                        out_write(out_buffer, unpack_string(registers[R_R0], out_buffer));
                         fflush(stdout);
                         break;
+                    case TRAP_HOST:
+                        call_host_function();
+                        break;
                     case TRAP_HALT:
-                        puts("HALT");
+                        // only the last stage reports it, earlier ones would feed it to the next guest
+                        if (!out_ring) {
+                            out_write("HALT\n", 5);
+                        }
                         fflush(stdout);
                         running = 0;
                         break;
                 }
                 break;
-            case OP_RES:
             case OP_RTI:
+                fault(STOP_PRIVILEGE, PM_PRIVILEGE, instr);
+                break;
+            case OP_RES:
             default:
-                abort();
+                fault(STOP_ILLEGAL_OPCODE, PM_ILLEGAL_OPCODE, instr);
                 break;
         }
     }
+    if (show_hwcounters) {
+        enable_hwcounters(0);
+    }
+    if (watchdog_seconds) {
+        alarm(0);
+    }
+    close_rings();
     restore_input_buffering();
+
+    if (stop_reason) {
+        fflush(stdout);
+        if (stage_count > 1) {
+            fprintf(stderr, "\nERROR : stage %d : %s at x%04X, postmortem in %s\n", stage + 1,
+                    stop_names[stop_reason], (uint16_t)(trace[instr_count % TRACE_SIZE] >> 16), postmortem_path);
+        } else {
+            fprintf(stderr, "\nERROR : %s at x%04X, postmortem in %s\n",
+                    stop_names[stop_reason], (uint16_t)(trace[instr_count % TRACE_SIZE] >> 16), postmortem_path);
+        }
+    }
+
+    if (show_stats) {
+        print_stats();
+    }
+    if (show_hwcounters) {
+        print_hwcounters();
+    }
+    if (profile_path) {
+        save_profile(profile_path);
+    }
+    int status = stop_reason;
+    if (stage == 0 && stage_count > 1) {
+        fflush(stdout);
+        int stages_status = wait_pipeline();
+        if (!status) {
+            status = stages_status;
+        }
+    }
+    if (script_file) {
+        if (expecting && !script_failed && !stop_reason) {
+            script_fail("guest halted before the expected output");
+        }
+        fclose(script_file);
+        if (script_failed && !status) {
+            status = 1;
+        }
+    }
+    return status;
 }
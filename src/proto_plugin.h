@@ -0,0 +1,48 @@
+// Proto plugin interface
+// plugins are shared objects loaded with --plugin
+// proto calls their proto_plugin_init() once, before the images are loaded
+#ifndef PROTO_PLUGIN_H
+#define PROTO_PLUGIN_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Host Functions
+// called by TRAP x26 with R0 holding the function number
+// they work on the guest's memory (1 << 16 words) and registers (R0 to R7, then PC) in place
+// the condition flags are set from R0 when the function returns
+typedef void (*proto_host_fn)(uint16_t* memory, uint16_t* registers);
+
+enum{
+    PROTO_HOST_FUNCTIONS = 256, // host function numbers go from 0 to 255
+    PROTO_DEVICE_FIRST = 0xFE40, // plugin devices live between here and 0xFFFF
+};
+
+// Devices
+// a device answers for the memory mapped registers from first to last, every callback is optional
+// without read the guest reads back what it last wrote
+struct proto_device {
+    uint16_t first;
+    uint16_t last;
+    void* context; // handed back to every callback
+    uint16_t (*read)(void* context, uint16_t address);
+    void (*write)(void* context, uint16_t address, uint16_t val);
+    // called at block boundaries (every branch, jump and trap) with the instructions retired so far
+    void (*tick)(void* context, uint64_t instructions);
+    // called when proto saves or restores the VM, return 0 on failure
+    int (*save)(void* context, FILE* file);
+    int (*restore)(void* context, FILE* file);
+};
+
+// Services proto offers to a plugin
+struct proto_host {
+    // returns 0 if the number is out of range or already taken
+    int (*register_function)(uint16_t number, proto_host_fn fn);
+    // returns 0 if the range is outside the plugin area or overlaps another device
+    int (*register_device)(const struct proto_device* device);
+};
+
+// Entry point every plugin exports, returns 0 to stop proto from starting
+int proto_plugin_init(struct proto_host* host);
+
+#endif